@@ -4,14 +4,19 @@
 
 namespace ogfx {
   constexpr uint16_t nullHandle = UINT16_MAX;
+  constexpr uint32_t materialTextureSize = 256;
 
+  // The generation tells a stale handle apart from a newer one reusing its id
   #define OGFX_HANDLE(name) \
-	struct name { uint16_t id = nullHandle; };
+	struct name { uint16_t id = nullHandle; uint16_t generation = 0; };
 
   OGFX_HANDLE(RenderPassHandle)
   OGFX_HANDLE(RenderPipelineHandle)
   OGFX_HANDLE(ShaderHandle)
   OGFX_HANDLE(BufferHandle)
+  OGFX_HANDLE(OcclusionQueryHandle)
+  OGFX_HANDLE(MaterialHandle)
+  OGFX_HANDLE(MaterialTextureHandle)
 
   struct PlatformData {
     void* nativeWindowHandle = nullptr;
@@ -22,13 +27,32 @@ namespace ogfx {
     uint32_t height = 480;
   };
 
+  // Renders the default pass into an offscreen target whose scale follows the
+  // measured GPU frame time, then upscales it into the swap chain.
+  struct DynamicResolution {
+    bool enabled = false;
+    float frameBudgetMs = 14.0f; // leaves headroom under a 60 Hz vsync
+    float minScale = 0.5f;
+    float maxScale = 1.0f;
+  };
+
   struct InitInfo {
     PlatformData platformData;
     Resolution resolution;
+    DynamicResolution dynamicResolution;
   };
 
+  // Pipelines using the material table get it bound at group 0:
+  //   @group(0) @binding(0) var<storage, read> materials: array<Material>;
+  //   @group(0) @binding(1) var materialTextures: texture_2d_array<f32>;
+  //   @group(0) @binding(2) var materialSampler: sampler;
+  // with struct Material { baseColor: vec4<f32>, textureLayer: u32 }.
+  // The material index of a draw is its instance_index.
   struct RenderPipelineDesc {
     ShaderHandle shader;
+    bool materialTable = false;
+    bool depthTest = false; // test and write depth, opaque geometry occluding later draws
+    bool occlusionProxy = false; // depth tested, writes neither color nor depth
   };
 
   struct Memory {
@@ -36,6 +60,11 @@ namespace ogfx {
     uint64_t size = 0;
   };
 
+  struct MaterialDesc {
+    float baseColor[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+    MaterialTextureHandle albedo; // white if null, can be shared between materials
+  };
+
   struct Context {
     bool init(const InitInfo& info);
     void shutdown();
@@ -43,11 +72,34 @@ namespace ogfx {
     RenderPipelineHandle newRenderPipeline(const RenderPipelineDesc& desc);
     ShaderHandle newShader(Memory mem);
     BufferHandle newBuffer(Memory mem);
+    // Only valid for the current frame, recycled once the GPU is done with it
+    BufferHandle newTransientBuffer(Memory mem);
+    OcclusionQueryHandle newOcclusionQuery();
+    MaterialHandle newMaterial(const MaterialDesc& desc);
+    // RGBA8, materialTextureSize x materialTextureSize. Null once the texture array is full.
+    MaterialTextureHandle newMaterialTexture(Memory mem);
+
+    // Released once the GPU has finished the frame they were last used in
+    void destroyRenderPipeline(RenderPipelineHandle handle);
+    void destroyShader(ShaderHandle handle);
+    void destroyBuffer(BufferHandle handle);
+    void destroyMaterial(MaterialHandle handle);
+    // Fails while a material still uses the texture
+    void destroyMaterialTexture(MaterialTextureHandle handle);
 
     void beginDefaultPass();
     void endPass();
     void applyPipeline(RenderPipelineHandle handle);
     void draw();
+    void draw(MaterialHandle material);
+    void beginOcclusionQuery(OcclusionQueryHandle handle);
+    void endOcclusionQuery();
+    // Result of the last resolved query, a few frames old. True until known.
+    // Keep querying hidden objects by drawing their bounds with an
+    // occlusionProxy pipeline, otherwise they never become visible again.
+    bool isVisible(OcclusionQueryHandle handle);
     void commitFrame();
+
+    float getResolutionScale();
   };
 }
\ No newline at end of file
@@ -24,6 +24,42 @@ namespace ogfx {
     return m_ctx.newBuffer(mem);
   }
 
+  BufferHandle Context::newTransientBuffer(Memory mem) {
+    return m_ctx.newTransientBuffer(mem);
+  }
+
+  OcclusionQueryHandle Context::newOcclusionQuery() {
+    return m_ctx.newOcclusionQuery();
+  }
+
+  MaterialHandle Context::newMaterial(const MaterialDesc& desc) {
+    return m_ctx.newMaterial(desc);
+  }
+
+  MaterialTextureHandle Context::newMaterialTexture(Memory mem) {
+    return m_ctx.newMaterialTexture(mem);
+  }
+
+  void Context::destroyRenderPipeline(RenderPipelineHandle handle) {
+    m_ctx.destroyRenderPipeline(handle);
+  }
+
+  void Context::destroyShader(ShaderHandle handle) {
+    m_ctx.destroyShader(handle);
+  }
+
+  void Context::destroyBuffer(BufferHandle handle) {
+    m_ctx.destroyBuffer(handle);
+  }
+
+  void Context::destroyMaterial(MaterialHandle handle) {
+    m_ctx.destroyMaterial(handle);
+  }
+
+  void Context::destroyMaterialTexture(MaterialTextureHandle handle) {
+    m_ctx.destroyMaterialTexture(handle);
+  }
+
   void Context::beginDefaultPass() {
     m_ctx.beginDefaultPass();
   }
@@ -40,7 +76,27 @@ namespace ogfx {
     m_ctx.draw();
   }
 
+  void Context::draw(MaterialHandle material) {
+    m_ctx.draw(material);
+  }
+
+  void Context::beginOcclusionQuery(OcclusionQueryHandle handle) {
+    m_ctx.beginOcclusionQuery(handle);
+  }
+
+  void Context::endOcclusionQuery() {
+    m_ctx.endOcclusionQuery();
+  }
+
+  bool Context::isVisible(OcclusionQueryHandle handle) {
+    return m_ctx.isVisible(handle);
+  }
+
   void Context::commitFrame() {
     m_ctx.commitFrame();
   }
+
+  float Context::getResolutionScale() {
+    return m_ctx.getResolutionScale();
+  }
 }
@@ -1,9 +1,44 @@
 #include "renderer_context.h"
 #include <iostream>
 #include <cassert>
+#include <cmath>
+#include <cfloat>
+#include <cstring>
 #include <Windows.h>
 
 namespace ogfx {
+  // Upscales the offscreen target with a fullscreen triangle
+  static const char* s_upscaleShader = R"(
+struct UpscaleParams {
+  uvScale: vec2<f32>,
+  uvMax: vec2<f32>,
+};
+
+@group(0) @binding(0) var sourceTexture: texture_2d<f32>;
+@group(0) @binding(1) var sourceSampler: sampler;
+@group(0) @binding(2) var<uniform> params: UpscaleParams;
+
+struct VertexOutput {
+  @builtin(position) position: vec4<f32>,
+  @location(0) uv: vec2<f32>,
+};
+
+@vertex
+fn vs_main(@builtin(vertex_index) index: u32) -> VertexOutput {
+  let uv = vec2<f32>(f32((index << 1u) & 2u), f32(index & 2u));
+  var output: VertexOutput;
+  output.position = vec4<f32>(uv.x * 2.0 - 1.0, 1.0 - uv.y * 2.0, 0.0, 1.0);
+  output.uv = uv;
+  return output;
+}
+
+@fragment
+fn fs_main(input: VertexOutput) -> @location(0) vec4<f32> {
+  let uv = min(input.uv * params.uvScale, params.uvMax);
+  return vec4<f32>(textureSample(sourceTexture, sourceSampler, uv).rgb, 1.0);
+}
+)";
+
   WGPUAdapter requestAdapter(WGPUInstance instance, WGPURequestAdapterOptions const* options) {
     // A simple structure holding the local information shared with the
     // onAdapterRequestEnded callback.
@@ -120,7 +155,7 @@ namespace ogfx {
     return adapter;
   }
 
-  WGPUDevice createDevice(WGPUAdapter adapter) {
+  WGPUDevice createDevice(WGPUAdapter adapter, bool timestampQuery) {
     WGPUSupportedLimits supportedLimits{};
     supportedLimits.nextInChain = nullptr;
 
@@ -165,7 +200,10 @@ namespace ogfx {
     WGPUDeviceDescriptor deviceDesc = {};
     deviceDesc.nextInChain = nullptr;
     deviceDesc.label = "Device"; // anything works here, that's your call
-    deviceDesc.requiredFeaturesCount = 0; // we do not require any specific feature
+    // Timestamps are only needed to time frames for dynamic resolution
+    WGPUFeatureName timestampFeature = WGPUFeatureName_TimestampQuery;
+    deviceDesc.requiredFeaturesCount = timestampQuery ? 1 : 0;
+    deviceDesc.requiredFeatures = timestampQuery ? &timestampFeature : nullptr;
     deviceDesc.requiredLimits = &requiredLimits;
     deviceDesc.defaultQueue.nextInChain = nullptr;
     deviceDesc.defaultQueue.label = "Default queue";
@@ -177,11 +215,11 @@ namespace ogfx {
     return device;
   }
 
-  WGPUSwapChain createSwapChain(WGPUDevice device, WGPUSurface surface) {
+  WGPUSwapChain createSwapChain(WGPUDevice device, WGPUSurface surface, Resolution resolution) {
     WGPUSwapChainDescriptor swapChainDesc = {};
     swapChainDesc.nextInChain = nullptr;
-    swapChainDesc.width = 640;
-    swapChainDesc.height = 480;
+    swapChainDesc.width = resolution.width;
+    swapChainDesc.height = resolution.height;
     swapChainDesc.usage = WGPUTextureUsage_RenderAttachment;
     swapChainDesc.presentMode = WGPUPresentMode_Fifo;
 
@@ -197,6 +235,35 @@ namespace ogfx {
     return swapChain;
   }
 
+  WGPUTexture createDepthTexture(WGPUDevice device, Resolution resolution) {
+    WGPUTextureDescriptor textureDesc = {};
+    textureDesc.nextInChain = nullptr;
+    textureDesc.label = "Depth texture";
+    textureDesc.usage = WGPUTextureUsage_RenderAttachment;
+    textureDesc.dimension = WGPUTextureDimension_2D;
+    textureDesc.size = { resolution.width, resolution.height, 1 };
+    textureDesc.format = DEPTH_FORMAT;
+    textureDesc.mipLevelCount = 1;
+    textureDesc.sampleCount = 1;
+    textureDesc.viewFormatCount = 0;
+    textureDesc.viewFormats = nullptr;
+    return wgpuDeviceCreateTexture(device, &textureDesc);
+  }
+
+  WGPUTextureView createDepthTextureView(WGPUTexture texture) {
+    WGPUTextureViewDescriptor viewDesc = {};
+    viewDesc.nextInChain = nullptr;
+    viewDesc.label = "Depth texture view";
+    viewDesc.format = DEPTH_FORMAT;
+    viewDesc.dimension = WGPUTextureViewDimension_2D;
+    viewDesc.baseMipLevel = 0;
+    viewDesc.mipLevelCount = 1;
+    viewDesc.baseArrayLayer = 0;
+    viewDesc.arrayLayerCount = 1;
+    viewDesc.aspect = WGPUTextureAspect_All;
+    return wgpuTextureCreateView(texture, &viewDesc);
+  }
+
   WGPUCommandEncoder createCmdEncoder(WGPUDevice device) {
     WGPUCommandEncoderDescriptor encoderDesc = {};
     encoderDesc.nextInChain = nullptr;
@@ -204,6 +271,15 @@ namespace ogfx {
     return wgpuDeviceCreateCommandEncoder(device, &encoderDesc);
   }
 
+  // Process pending callbacks (map requests, work done) without blocking
+  void pollDevice(WGPUDevice device) {
+#ifdef WEBGPU_BACKEND_DAWN
+    wgpuDeviceTick(device);
+#elif defined(WEBGPU_BACKEND_WGPU)
+    wgpuDevicePoll(device, false, nullptr);
+#endif
+  }
+
   std::vector<WGPUFeatureName> retrieveFeatures(WGPUAdapter adapter) {
     std::vector<WGPUFeatureName> features;
 
@@ -243,8 +319,23 @@ namespace ogfx {
 
     }
 
+    bool timestampQuery = false;
+    if (info.dynamicResolution.enabled) {
+      for (auto f : m_features) {
+        if (f == WGPUFeatureName_TimestampQuery) {
+          timestampQuery = true;
+        }
+      }
+    }
+
     std::cout << "Requesting device..." << std::endl;
-    m_device = createDevice(m_adapter);
+    m_device = createDevice(m_adapter, timestampQuery);
+    if (!m_device && timestampQuery) {
+      // Listed by the adapter but refused, time frames without it
+      std::cerr << "Device request with timestamp queries failed, retrying without" << std::endl;
+      timestampQuery = false;
+      m_device = createDevice(m_adapter, false);
+    }
     if (!m_device) {
       std::cerr << "Device request failed" << std::endl;
       return false;
@@ -260,7 +351,7 @@ namespace ogfx {
 
     m_queue = wgpuDeviceGetQueue(m_device);
 
-    m_swapChain = createSwapChain(m_device, m_surface);
+    m_swapChain = createSwapChain(m_device, m_surface, info.resolution);
     if (!m_swapChain) {
       std::cerr << "Swap chain creation failed" << std::endl;
       return false;
@@ -269,10 +360,38 @@ namespace ogfx {
 
     m_cmdEncoder = createCmdEncoder(m_device);
 
+    // Same size as the offscreen target when using dynamic resolution
+    m_depthTexture = createDepthTexture(m_device, info.resolution);
+    m_depthTextureView = createDepthTextureView(m_depthTexture);
+
+    m_occlusionQueries.create(m_device);
+
+    m_dynamicResolution = info.dynamicResolution.enabled;
+    if (m_dynamicResolution) {
+      m_resolutionController.init(info.dynamicResolution);
+      m_upscalePass.create(m_device, info.resolution);
+      m_frameTimer.create(m_device, timestampQuery);
+      if (!timestampQuery) {
+        std::cout << "No timestamp queries, frame times are approximated" << std::endl;
+      }
+    }
+
     return true;
   }
 
   void RendererContext::shutdown() {
+    m_occlusionQueries.destroy();
+    if (m_materialTable.m_created) {
+      m_materialTable.destroy();
+    }
+    if (m_dynamicResolution) {
+      m_upscalePass.destroy();
+      m_frameTimer.destroy();
+    }
+    m_deletionQueue.flush();
+    wgpuTextureViewRelease(m_depthTextureView);
+    wgpuTextureDestroy(m_depthTexture);
+    wgpuTextureRelease(m_depthTexture);
     wgpuSwapChainRelease(m_swapChain);
     wgpuDeviceRelease(m_device);
     wgpuSurfaceRelease(m_surface);
@@ -282,18 +401,48 @@ namespace ogfx {
 
   RenderPipelineHandle RendererContext::newRenderPipeline(const RenderPipelineDesc& desc) {
     RenderPipelineHandle handle;
-    m_renderPipelineAlloc.allocate(handle);
+    if (!m_renderPipelineAlloc.allocate(handle)) {
+      std::cerr << "Too many render pipelines" << std::endl;
+      return handle;
+    }
+    if (!m_shaderAlloc.isValid(desc.shader)) {
+      std::cerr << "Invalid shader handle: " << desc.shader.id << std::endl;
+      m_renderPipelineAlloc.free(handle);
+      handle.id = nullHandle;
+      return handle;
+    }
 
     const Shader& shader = m_shaders[desc.shader.id];
 
-    m_renderPipelines[handle.id].create(m_device, shader.m_shaderModule);
+    WGPUPipelineLayout layout = nullptr;
+    if (desc.materialTable) {
+      if (!m_materialTable.m_created) {
+        m_materialTable.create(m_device, m_queue);
+      }
+      layout = m_materialTable.m_pipelineLayout;
+    }
+
+    RenderPipeline& pipe = m_renderPipelines[handle.id];
+    // The default pass always has a depth attachment, pipelines opt into using it
+    DepthMode depthMode = DepthMode::Ignore;
+    if (desc.occlusionProxy) {
+      depthMode = DepthMode::TestOnly;
+    }
+    else if (desc.depthTest) {
+      depthMode = DepthMode::TestWrite;
+    }
+    pipe.create(m_device, shader.m_shaderModule, layout, depthMode, !desc.occlusionProxy);
+    pipe.m_materialTable = desc.materialTable;
 
     return handle;
   }
 
   ShaderHandle RendererContext::newShader(Memory mem) {
     ShaderHandle handle;
-    m_shaderAlloc.allocate(handle);
+    if (!m_shaderAlloc.allocate(handle)) {
+      std::cerr << "Too many shaders" << std::endl;
+      return handle;
+    }
 
     m_shaders[handle.id].create(m_device, mem);
 
@@ -302,7 +451,10 @@ namespace ogfx {
 
   BufferHandle RendererContext::newBuffer(Memory mem) {
     BufferHandle handle;
-    m_bufferAlloc.allocate(handle);
+    if (!m_bufferAlloc.allocate(handle)) {
+      std::cerr << "Too many buffers" << std::endl;
+      return handle;
+    }
 
     Buffer& buffer = m_buffers[handle.id];
     buffer.create(m_device);
@@ -311,50 +463,270 @@ namespace ogfx {
     return handle;
   }
 
-  void RendererContext::beginDefaultPass() {
-    // Get texture view from the swap chain
-    m_nextTexture = wgpuSwapChainGetCurrentTextureView(m_swapChain);
-    if (!m_nextTexture) {
-      std::cerr << "Cannot acquire next swap chain texture" << std::endl;
+  BufferHandle RendererContext::newTransientBuffer(Memory mem) {
+    BufferHandle handle;
+    if (!m_bufferAlloc.allocate(handle)) {
+      std::cerr << "Too many buffers" << std::endl;
+      return handle;
+    }
+
+    Buffer& buffer = m_buffers[handle.id];
+    buffer.createTransient(m_device, m_deletionQueue, mem.size);
+    buffer.write(m_queue, mem);
+
+    // Handed back to the deletion queue at the end of the frame
+    m_transientBuffers.push_back(handle);
+
+    return handle;
+  }
+
+  MaterialHandle RendererContext::newMaterial(const MaterialDesc& desc) {
+    MaterialHandle handle;
+    if (desc.albedo.id != nullHandle && !m_materialTextureAlloc.isValid(desc.albedo)) {
+      std::cerr << "Invalid material texture handle: " << desc.albedo.id << std::endl;
+      return handle;
+    }
+    if (!m_materialAlloc.allocate(handle)) {
+      std::cerr << "Too many materials" << std::endl;
+      return handle;
+    }
+
+    if (!m_materialTable.m_created) {
+      m_materialTable.create(m_device, m_queue);
+    }
+    m_materialTable.write(m_queue, handle, desc);
+
+    return handle;
+  }
+
+  MaterialTextureHandle RendererContext::newMaterialTexture(Memory mem) {
+    MaterialTextureHandle handle;
+    if (mem.size != uint64_t(materialTextureSize) * materialTextureSize * 4) {
+      std::cerr << "Material texture must be " << materialTextureSize << "x" << materialTextureSize << " RGBA8" << std::endl;
+      return handle;
+    }
+    if (!m_materialTextureAlloc.allocate(handle)) {
+      std::cerr << "Material texture array is full" << std::endl;
+      return handle;
+    }
+
+    if (!m_materialTable.m_created) {
+      m_materialTable.create(m_device, m_queue);
+    }
+    m_materialTable.writeTexture(m_queue, handle, mem.data);
+
+    return handle;
+  }
+
+  OcclusionQueryHandle RendererContext::newOcclusionQuery() {
+    OcclusionQueryHandle handle;
+    if (!m_occlusionQueryAlloc.allocate(handle)) {
+      std::cerr << "Too many occlusion queries" << std::endl;
+      return handle;
+    }
+
+    // Assume visible until a result comes back, ignoring results still in flight for a recycled id
+    m_occlusionQueries.m_visible[handle.id] = true;
+    m_occlusionQueries.m_resultFrame[handle.id] = m_frame + 1;
+
+    return handle;
+  }
+
+  void RendererContext::destroyRenderPipeline(RenderPipelineHandle handle) {
+    if (!m_renderPipelineAlloc.isValid(handle)) {
+      return;
+    }
+
+    m_renderPipelines[handle.id].destroy(m_deletionQueue, m_frame);
+    m_renderPipelineAlloc.free(handle);
+  }
+
+  void RendererContext::destroyShader(ShaderHandle handle) {
+    if (!m_shaderAlloc.isValid(handle)) {
+      return;
+    }
+
+    m_shaders[handle.id].destroy(m_deletionQueue, m_frame);
+    m_shaderAlloc.free(handle);
+  }
+
+  void RendererContext::destroyBuffer(BufferHandle handle) {
+    if (!m_bufferAlloc.isValid(handle)) {
       return;
     }
 
+    Buffer& buffer = m_buffers[handle.id];
+    if (buffer.m_transient) {
+      return; // released at the end of the frame
+    }
+
+    buffer.destroy(m_deletionQueue, m_frame);
+    m_bufferAlloc.free(handle);
+  }
+
+  void RendererContext::destroyMaterial(MaterialHandle handle) {
+    if (!m_materialAlloc.isValid(handle)) {
+      return;
+    }
+
+    // The params slot keeps its data until the GPU is done with the frame
+    m_materialTable.release(handle);
+    m_materialAlloc.free(handle, m_deletionQueue, m_frame);
+  }
+
+  void RendererContext::destroyMaterialTexture(MaterialTextureHandle handle) {
+    if (!m_materialTextureAlloc.isValid(handle)) {
+      return;
+    }
+    if (m_materialTable.isTextureUsed(handle)) {
+      std::cerr << "Material texture " << handle.id << " is still used by a material" << std::endl;
+      return;
+    }
+
+    // Same for the layer, reused once the GPU is done with the frame
+    m_materialTextureAlloc.free(handle, m_deletionQueue, m_frame);
+  }
+
+  void RendererContext::beginDefaultPass() {
+    WGPUTextureView target;
+    if (m_dynamicResolution) {
+      // Render into the offscreen target, upscaled at commit
+      m_upscalePass.setScale(m_resolutionController.m_scale);
+      target = m_upscalePass.m_textureView;
+    }
+    else {
+      // Get texture view from the swap chain
+      m_nextTexture = wgpuSwapChainGetCurrentTextureView(m_swapChain);
+      if (!m_nextTexture) {
+        std::cerr << "Cannot acquire next swap chain texture" << std::endl;
+        return;
+      }
+      target = m_nextTexture;
+    }
+
     // Define attachments
     WGPURenderPassColorAttachment renderPassColorAttachment = {};
-    renderPassColorAttachment.view = m_nextTexture;
+    renderPassColorAttachment.view = target;
     renderPassColorAttachment.resolveTarget = nullptr;
     renderPassColorAttachment.loadOp = WGPULoadOp_Clear;
     renderPassColorAttachment.storeOp = WGPUStoreOp_Store;
     renderPassColorAttachment.clearValue = WGPUColor{ 0.9, 0.1, 0.2, 1.0 };
 
+    // Occlusion queries only mean something with depth testing
+    WGPURenderPassDepthStencilAttachment depthStencilAttachment = {};
+    depthStencilAttachment.view = m_depthTextureView;
+    depthStencilAttachment.depthLoadOp = WGPULoadOp_Clear;
+    depthStencilAttachment.depthStoreOp = WGPUStoreOp_Store;
+    depthStencilAttachment.depthClearValue = 1.0f;
+    depthStencilAttachment.depthReadOnly = false;
+#ifdef WEBGPU_BACKEND_WGPU
+    depthStencilAttachment.stencilLoadOp = WGPULoadOp_Clear;
+    depthStencilAttachment.stencilStoreOp = WGPUStoreOp_Store;
+#else
+    depthStencilAttachment.stencilLoadOp = WGPULoadOp_Undefined;
+    depthStencilAttachment.stencilStoreOp = WGPUStoreOp_Undefined;
+#endif
+    depthStencilAttachment.stencilClearValue = 0;
+    depthStencilAttachment.stencilReadOnly = true;
+
     // Define Render Pass
     WGPURenderPassDescriptor renderPassDesc = {};
     renderPassDesc.colorAttachmentCount = 1;
     renderPassDesc.colorAttachments = &renderPassColorAttachment;
-    renderPassDesc.depthStencilAttachment = nullptr;
-    renderPassDesc.timestampWriteCount = 0; // for measurements
-    renderPassDesc.timestampWrites = nullptr; // for measurements
+    renderPassDesc.depthStencilAttachment = &depthStencilAttachment;
+    // Frame timing starts with the first default pass of the frame
+    const WGPURenderPassTimestampWrite* timestampWrite = m_dynamicResolution ? m_frameTimer.beginWrite() : nullptr;
+    renderPassDesc.timestampWriteCount = timestampWrite ? 1 : 0;
+    renderPassDesc.timestampWrites = timestampWrite;
+    renderPassDesc.occlusionQuerySet = m_occlusionQueries.m_querySet;
     renderPassDesc.nextInChain = nullptr;
 
     m_currentRenderPass = wgpuCommandEncoderBeginRenderPass(m_cmdEncoder, &renderPassDesc);
+    m_materialTableBound = false;
+    m_occlusionQueries.beginPass();
+
+    if (m_dynamicResolution) {
+      const float width = static_cast<float>(m_upscalePass.m_width);
+      const float height = static_cast<float>(m_upscalePass.m_height);
+      wgpuRenderPassEncoderSetViewport(m_currentRenderPass, 0.0f, 0.0f, width, height, 0.0f, 1.0f);
+      wgpuRenderPassEncoderSetScissorRect(m_currentRenderPass, 0, 0, m_upscalePass.m_width, m_upscalePass.m_height);
+    }
   }
 
   void RendererContext::endPass() {
+    m_occlusionQueries.endPass(m_currentRenderPass);
     wgpuRenderPassEncoderEnd(m_currentRenderPass);
     wgpuRenderPassEncoderRelease(m_currentRenderPass); // useful? 
   }
 
   void RendererContext::applyPipeline(RenderPipelineHandle handle) {
+    if (!m_renderPipelineAlloc.isValid(handle)) {
+      std::cerr << "Invalid render pipeline handle: " << handle.id << std::endl;
+      return;
+    }
     const RenderPipeline& pipe = m_renderPipelines[handle.id];
 
     wgpuRenderPassEncoderSetPipeline(m_currentRenderPass, pipe.m_renderPipeline);
+
+    // Shared by every material table pipeline, bound once per pass
+    if (pipe.m_materialTable && !m_materialTableBound) {
+      wgpuRenderPassEncoderSetBindGroup(m_currentRenderPass, 0, m_materialTable.m_bindGroup, 0, nullptr);
+      m_materialTableBound = true;
+    }
   }
 
   void RendererContext::draw() {
     wgpuRenderPassEncoderDraw(m_currentRenderPass, 3, 1, 0, 0);
   }
 
+  void RendererContext::draw(MaterialHandle material) {
+    if (!m_materialAlloc.isValid(material)) {
+      std::cerr << "Invalid material handle: " << material.id << std::endl;
+      return;
+    }
+    // The material index reaches the shader through instance_index
+    wgpuRenderPassEncoderDraw(m_currentRenderPass, 3, 1, 0, material.id);
+  }
+
+  void RendererContext::beginOcclusionQuery(OcclusionQueryHandle handle) {
+    if (!m_occlusionQueryAlloc.isValid(handle)) {
+      std::cerr << "Invalid occlusion query handle: " << handle.id << std::endl;
+      return;
+    }
+    m_occlusionQueries.begin(m_currentRenderPass, handle);
+  }
+
+  void RendererContext::endOcclusionQuery() {
+    m_occlusionQueries.end(m_currentRenderPass);
+  }
+
+  bool RendererContext::isVisible(OcclusionQueryHandle handle) {
+    if (!m_occlusionQueryAlloc.isValid(handle)) {
+      return true;
+    }
+    return m_occlusionQueries.isVisible(handle);
+  }
+
   void RendererContext::commitFrame() {
+    // Notice work done before blocking on the swap chain
+    pollDevice(m_device);
+
+    if (m_dynamicResolution) {
+      FrameFence::Clock::time_point acquireStart = FrameFence::Clock::now();
+      m_nextTexture = wgpuSwapChainGetCurrentTextureView(m_swapChain);
+      m_frameFence.addBlocked(FrameFence::Clock::now() - acquireStart);
+      if (m_nextTexture) {
+        m_upscalePass.execute(m_cmdEncoder, m_queue, m_nextTexture, m_frameTimer.endWrite());
+      }
+      else {
+        // Still submit the offscreen work, only the upscale and present are skipped
+        std::cerr << "Cannot acquire next swap chain texture" << std::endl;
+      }
+      m_frameTimer.resolve(m_cmdEncoder, m_frame);
+    }
+
+    m_occlusionQueries.resolve(m_cmdEncoder, m_frame);
+
     // Create command buffer from encoder
     WGPUCommandBufferDescriptor cmdBufferDescriptor = {};
     cmdBufferDescriptor.nextInChain = nullptr;
@@ -364,19 +736,50 @@ namespace ogfx {
     // Submit the command queue
     wgpuQueueSubmit(m_queue, 1, &command);
 
+    m_occlusionQueries.readback(m_frame);
+    m_frameFence.submit(m_queue, m_frame);
+    if (m_dynamicResolution) {
+      m_frameTimer.readback(m_frame);
+    }
+
+    for (BufferHandle handle : m_transientBuffers) {
+      m_buffers[handle.id].destroy(m_deletionQueue, m_frame);
+      m_bufferAlloc.free(handle);
+    }
+    m_transientBuffers.clear();
+
 #ifdef WEBGPU_BACKEND_DAWN
     wgpuCommandEncoderRelease(m_cmdEncoder);
     wgpuCommandBufferRelease(command);
 #endif
 
-    wgpuTextureViewRelease(m_nextTexture);
+    if (m_nextTexture) {
+      wgpuTextureViewRelease(m_nextTexture);
+      m_nextTexture = nullptr;
 
-    wgpuSwapChainPresent(m_swapChain);
+      FrameFence::Clock::time_point presentStart = FrameFence::Clock::now();
+      wgpuSwapChainPresent(m_swapChain);
+      m_frameFence.addBlocked(FrameFence::Clock::now() - presentStart);
+    }
+
+    pollDevice(m_device);
+    m_occlusionQueries.update();
+    m_deletionQueue.collect(m_frame, m_frameFence.m_completedFrames);
 
+    float gpuTimeMs;
+    if (m_dynamicResolution && m_frameTimer.consume(m_frameFence, gpuTimeMs)) {
+      m_resolutionController.update(gpuTimeMs);
+    }
+
+    m_frame++;
     m_cmdEncoder = createCmdEncoder(m_device);
   }
 
-  bool RenderPipeline::create(WGPUDevice device, WGPUShaderModule shaderModule) {
+  float RendererContext::getResolutionScale() {
+    return m_dynamicResolution ? m_resolutionController.m_scale : 1.0f;
+  }
+
+  bool RenderPipeline::create(WGPUDevice device, WGPUShaderModule shaderModule, WGPUPipelineLayout layout, DepthMode depthMode, bool colorWrites) {
     WGPURenderPipelineDescriptor pipelineDesc{};
     pipelineDesc.nextInChain = nullptr;
     pipelineDesc.vertex.bufferCount = 0;
@@ -397,7 +800,27 @@ namespace ogfx {
     fragmentState.constants = nullptr;
     pipelineDesc.fragment = &fragmentState;
 
-    pipelineDesc.depthStencil = nullptr;
+    WGPUStencilFaceState stencilFace{};
+    stencilFace.compare = WGPUCompareFunction_Always;
+    stencilFace.failOp = WGPUStencilOperation_Keep;
+    stencilFace.depthFailOp = WGPUStencilOperation_Keep;
+    stencilFace.passOp = WGPUStencilOperation_Keep;
+
+    WGPUDepthStencilState depthStencilState{};
+    depthStencilState.nextInChain = nullptr;
+    depthStencilState.format = DEPTH_FORMAT;
+    // Proxies only test against the scene, they must not occlude anything
+    depthStencilState.depthWriteEnabled = depthMode == DepthMode::TestWrite;
+    depthStencilState.depthCompare = depthMode == DepthMode::Ignore ? WGPUCompareFunction_Always : WGPUCompareFunction_LessEqual;
+    depthStencilState.stencilFront = stencilFace;
+    depthStencilState.stencilBack = stencilFace;
+    depthStencilState.stencilReadMask = 0;
+    depthStencilState.stencilWriteMask = 0;
+    depthStencilState.depthBias = 0;
+    depthStencilState.depthBiasSlopeScale = 0.0f;
+    depthStencilState.depthBiasClamp = 0.0f;
+
+    pipelineDesc.depthStencil = depthMode == DepthMode::NoAttachment ? nullptr : &depthStencilState;
 
     WGPUBlendState blendState{};
     blendState.color.srcFactor = WGPUBlendFactor_SrcAlpha;
@@ -410,7 +833,7 @@ namespace ogfx {
     WGPUColorTargetState colorTarget{};
     colorTarget.format = WGPUTextureFormat_BGRA8Unorm; // todo: parametrize (for wgpu)
     colorTarget.blend = &blendState;
-    colorTarget.writeMask = WGPUColorWriteMask_All;
+    colorTarget.writeMask = colorWrites ? WGPUColorWriteMask_All : WGPUColorWriteMask_None;
 
     fragmentState.targetCount = 1;
     fragmentState.targets = &colorTarget;
@@ -422,15 +845,20 @@ namespace ogfx {
     // Default value as well (irrelevant for count = 1 anyways)
     pipelineDesc.multisample.alphaToCoverageEnabled = false;
 
-    pipelineDesc.layout = nullptr;
+    pipelineDesc.layout = layout; // nullptr for an automatic layout
 
     m_renderPipeline = wgpuDeviceCreateRenderPipeline(device, &pipelineDesc);
 
     return true;
   }
 
-  void RenderPipeline::destroy() {
+  void RenderPipeline::destroy(DeletionQueue& deletionQueue, uint64_t frame) {
+    if (!m_renderPipeline) {
+      return;
+    }
 
+    deletionQueue.push(m_renderPipeline, frame);
+    m_renderPipeline = nullptr;
   }
 
   bool Shader::create(WGPUDevice device, Memory mem) {
@@ -454,7 +882,13 @@ namespace ogfx {
     return true;
   }
 
-  void Shader::destroy() {
+  void Shader::destroy(DeletionQueue& deletionQueue, uint64_t frame) {
+    if (!m_shaderModule) {
+      return;
+    }
+
+    deletionQueue.push(m_shaderModule, frame);
+    m_shaderModule = nullptr;
   }
 
   bool Buffer::create(WGPUDevice device) {
@@ -465,16 +899,947 @@ namespace ogfx {
     bufferDesc.size = 16;
     bufferDesc.mappedAtCreation = false;
     m_buffer = wgpuDeviceCreateBuffer(device, &bufferDesc);
+    m_usage = bufferDesc.usage;
+    m_size = bufferDesc.size;
+    m_transient = false;
+
+    return true;
+  }
+
+  bool Buffer::createTransient(WGPUDevice device, DeletionQueue& deletionQueue, uint64_t size) {
+    m_usage = WGPUBufferUsage_CopyDst | WGPUBufferUsage_CopySrc;
+    // Buffer sizes must be a multiple of 4
+    DeletionQueue::TransientBuffer transient = deletionQueue.acquireTransient(device, m_usage, (size + 3) & ~uint64_t(3));
+    m_buffer = transient.m_buffer;
+    m_size = transient.m_size;
+    m_transient = true;
 
     return true;
   }
 
   void Buffer::write(WGPUQueue queue, Memory mem) {
-    wgpuQueueWriteBuffer(queue, m_buffer, 0, mem.data, mem.size);
+    // Writes must be a multiple of 4 bytes and fit in the buffer
+    const uint64_t alignedSize = (mem.size + 3) & ~uint64_t(3);
+    if (alignedSize > m_size) {
+      std::cerr << "Buffer write of " << mem.size << " bytes exceeds buffer size " << m_size << std::endl;
+      return;
+    }
+
+    if (alignedSize == mem.size) {
+      wgpuQueueWriteBuffer(queue, m_buffer, 0, mem.data, static_cast<size_t>(mem.size));
+      return;
+    }
+
+    std::vector<uint8_t> padded(static_cast<size_t>(alignedSize), 0);
+    memcpy(padded.data(), mem.data, static_cast<size_t>(mem.size));
+    wgpuQueueWriteBuffer(queue, m_buffer, 0, padded.data(), padded.size());
+  }
+
+  void Buffer::destroy(DeletionQueue& deletionQueue, uint64_t frame) {
+    if (!m_buffer) {
+      return;
+    }
+
+    if (m_transient) {
+      deletionQueue.pushTransient(m_buffer, m_usage, m_size, frame);
+    }
+    else {
+      deletionQueue.push(m_buffer, frame);
+    }
+    m_buffer = nullptr;
+    m_transient = false;
+  }
+
+  void DeletionQueue::push(WGPUBuffer buffer, uint64_t frame) {
+    Entry entry = {};
+    entry.m_type = ResourceType::Buffer;
+    entry.m_frame = frame;
+    entry.m_buffer = buffer;
+    m_entries.push_back(entry);
+  }
+
+  void DeletionQueue::push(WGPUTexture texture, uint64_t frame) {
+    Entry entry = {};
+    entry.m_type = ResourceType::Texture;
+    entry.m_frame = frame;
+    entry.m_texture = texture;
+    m_entries.push_back(entry);
+  }
+
+  void DeletionQueue::push(WGPUTextureView textureView, uint64_t frame) {
+    Entry entry = {};
+    entry.m_type = ResourceType::TextureView;
+    entry.m_frame = frame;
+    entry.m_textureView = textureView;
+    m_entries.push_back(entry);
+  }
+
+  void DeletionQueue::push(WGPUBindGroup bindGroup, uint64_t frame) {
+    Entry entry = {};
+    entry.m_type = ResourceType::BindGroup;
+    entry.m_frame = frame;
+    entry.m_bindGroup = bindGroup;
+    m_entries.push_back(entry);
+  }
+
+  void DeletionQueue::push(WGPURenderPipeline renderPipeline, uint64_t frame) {
+    Entry entry = {};
+    entry.m_type = ResourceType::RenderPipeline;
+    entry.m_frame = frame;
+    entry.m_renderPipeline = renderPipeline;
+    m_entries.push_back(entry);
+  }
+
+  void DeletionQueue::push(WGPUShaderModule shaderModule, uint64_t frame) {
+    Entry entry = {};
+    entry.m_type = ResourceType::ShaderModule;
+    entry.m_frame = frame;
+    entry.m_shaderModule = shaderModule;
+    m_entries.push_back(entry);
+  }
+
+  void DeletionQueue::push(RecycleFn recycle, void* allocator, uint16_t id, uint64_t frame) {
+    Entry entry = {};
+    entry.m_type = ResourceType::HandleId;
+    entry.m_frame = frame;
+    entry.m_allocator = allocator;
+    entry.m_recycle = recycle;
+    entry.m_id = id;
+    m_entries.push_back(entry);
+  }
+
+  void DeletionQueue::pushTransient(WGPUBuffer buffer, WGPUBufferUsageFlags usage, uint64_t size, uint64_t frame) {
+    Entry entry = {};
+    entry.m_type = ResourceType::TransientBuffer;
+    entry.m_frame = frame;
+    entry.m_buffer = buffer;
+    entry.m_usage = usage;
+    entry.m_size = size;
+    m_entries.push_back(entry);
+  }
+
+  DeletionQueue::TransientBuffer DeletionQueue::acquireTransient(WGPUDevice device, WGPUBufferUsageFlags usage, uint64_t size) {
+    // Only buffers the GPU is done with are in the pool, take the best fit
+    size_t best = m_transientBuffers.size();
+    for (size_t i = 0; i < m_transientBuffers.size(); ++i) {
+      const TransientBuffer& transient = m_transientBuffers[i];
+      if (transient.m_usage != usage || transient.m_size < size) {
+        continue;
+      }
+      if (best == m_transientBuffers.size() || transient.m_size < m_transientBuffers[best].m_size) {
+        best = i;
+      }
+    }
+
+    if (best != m_transientBuffers.size()) {
+      TransientBuffer transient = m_transientBuffers[best];
+      m_transientBuffers[best] = m_transientBuffers.back();
+      m_transientBuffers.pop_back();
+      return transient;
+    }
+
+    WGPUBufferDescriptor bufferDesc = {};
+    bufferDesc.nextInChain = nullptr;
+    bufferDesc.label = "Transient buffer";
+    bufferDesc.usage = usage;
+    bufferDesc.size = size;
+    bufferDesc.mappedAtCreation = false;
+
+    TransientBuffer transient = {};
+    transient.m_buffer = wgpuDeviceCreateBuffer(device, &bufferDesc);
+    transient.m_usage = usage;
+    transient.m_size = size;
+    return transient;
+  }
+
+  void DeletionQueue::collect(uint64_t frame, uint64_t completedFrames) {
+    while (!m_entries.empty() && m_entries.front().m_frame < completedFrames) {
+      release(m_entries.front());
+      m_entries.pop_front();
+    }
+
+    // Trim pooled buffers that have not been reused for a while, they are
+    // already done on the GPU so they can go right away
+    for (size_t i = 0; i < m_transientBuffers.size();) {
+      const TransientBuffer& transient = m_transientBuffers[i];
+      if (frame - transient.m_lastFrame <= TRANSIENT_BUFFER_MAX_IDLE_FRAMES) {
+        ++i;
+        continue;
+      }
+
+      wgpuBufferDestroy(transient.m_buffer);
+      wgpuBufferRelease(transient.m_buffer);
+      m_transientBuffers[i] = m_transientBuffers.back();
+      m_transientBuffers.pop_back();
+    }
+  }
+
+  void DeletionQueue::flush() {
+    for (const Entry& entry : m_entries) {
+      release(entry);
+    }
+    m_entries.clear();
+
+    for (const TransientBuffer& transient : m_transientBuffers) {
+      wgpuBufferDestroy(transient.m_buffer);
+      wgpuBufferRelease(transient.m_buffer);
+    }
+    m_transientBuffers.clear();
+  }
+
+  void DeletionQueue::release(const Entry& entry) {
+    switch (entry.m_type) {
+    case ResourceType::Buffer:
+      wgpuBufferDestroy(entry.m_buffer);
+      wgpuBufferRelease(entry.m_buffer);
+      break;
+    case ResourceType::TransientBuffer:
+      m_transientBuffers.push_back({ entry.m_buffer, entry.m_usage, entry.m_size, entry.m_frame });
+      break;
+    case ResourceType::Texture:
+      wgpuTextureDestroy(entry.m_texture);
+      wgpuTextureRelease(entry.m_texture);
+      break;
+    case ResourceType::TextureView:
+      wgpuTextureViewRelease(entry.m_textureView);
+      break;
+    case ResourceType::BindGroup:
+      wgpuBindGroupRelease(entry.m_bindGroup);
+      break;
+    case ResourceType::RenderPipeline:
+      wgpuRenderPipelineRelease(entry.m_renderPipeline);
+      break;
+    case ResourceType::ShaderModule:
+      wgpuShaderModuleRelease(entry.m_shaderModule);
+      break;
+    case ResourceType::HandleId:
+      entry.m_recycle(entry.m_allocator, entry.m_id);
+      break;
+    }
+  }
+
+  void FrameFence::submit(WGPUQueue queue, uint64_t frame) {
+    // Work done callbacks fire in submission order
+    auto onQueueWorkDone = [](WGPUQueueWorkDoneStatus /* status */, void* pUserData) {
+      FrameFence& fence = *reinterpret_cast<FrameFence*>(pUserData);
+      const Submit& submit = fence.m_submits.front();
+
+      // Time spent waiting on the swap chain is not GPU work for this frame
+      Clock::duration elapsed = (Clock::now() - submit.m_time) - (fence.m_blocked - submit.m_blocked);
+      float elapsedMs = std::chrono::duration<float, std::milli>(elapsed).count();
+      if (elapsedMs < 0.0f) {
+        elapsedMs = 0.0f;
+      }
+      if (!fence.m_hasElapsed || elapsedMs > fence.m_elapsedMs) {
+        fence.m_elapsedMs = elapsedMs;
+      }
+      fence.m_hasElapsed = true;
+
+      fence.m_completedFrames = submit.m_frame + 1;
+      fence.m_submits.pop_front();
+      };
+
+    Submit submit;
+    submit.m_frame = frame;
+    submit.m_time = Clock::now();
+    submit.m_blocked = m_blocked;
+    m_submits.push_back(submit);
+    wgpuQueueOnSubmittedWorkDone(queue, onQueueWorkDone, (void*)this);
+  }
+
+  void FrameFence::addBlocked(Clock::duration duration) {
+    m_blocked += duration;
+  }
+
+  bool FrameFence::consumeElapsed(float& elapsedMs) {
+    if (!m_hasElapsed) {
+      return false;
+    }
+
+    elapsedMs = m_elapsedMs;
+    m_hasElapsed = false;
+    return true;
+  }
+
+  bool QueryReadback::create(WGPUDevice device, uint32_t queryCount, const char* label) {
+    // One 64-bit value per query
+    WGPUBufferDescriptor bufferDesc = {};
+    bufferDesc.nextInChain = nullptr;
+    bufferDesc.label = label;
+    bufferDesc.usage = WGPUBufferUsage_QueryResolve | WGPUBufferUsage_CopySrc;
+    bufferDesc.size = queryCount * sizeof(uint64_t);
+    bufferDesc.mappedAtCreation = false;
+    m_resolveBuffer = wgpuDeviceCreateBuffer(device, &bufferDesc);
+
+    bufferDesc.usage = WGPUBufferUsage_MapRead | WGPUBufferUsage_CopyDst;
+    for (Slot& slot : m_slots) {
+      slot.m_buffer = wgpuDeviceCreateBuffer(device, &bufferDesc);
+      slot.m_state = SlotState::Free;
+    }
+
+    return true;
+  }
+
+  bool QueryReadback::resolve(WGPUCommandEncoder cmdEncoder, WGPUQuerySet querySet, uint32_t queryCount, uint64_t frame) {
+    Slot& slot = m_slots[frame % READBACK_FRAMES];
+    if (slot.m_state != SlotState::Free) {
+      // The GPU is still behind on this slot: drop this frame's results
+      // rather than wait, previous results stay in place
+      return false;
+    }
+
+    slot.m_size = queryCount * sizeof(uint64_t);
+    wgpuCommandEncoderResolveQuerySet(cmdEncoder, querySet, 0, queryCount, m_resolveBuffer, 0);
+    wgpuCommandEncoderCopyBufferToBuffer(cmdEncoder, m_resolveBuffer, 0, slot.m_buffer, 0, slot.m_size);
+    slot.m_frame = frame;
+    slot.m_state = SlotState::Resolved;
+    return true;
+  }
+
+  void QueryReadback::map(uint64_t frame) {
+    Slot& slot = m_slots[frame % READBACK_FRAMES];
+    if (slot.m_state != SlotState::Resolved) {
+      return;
+    }
+
+    auto onBufferMapped = [](WGPUBufferMapAsyncStatus status, void* pUserData) {
+      Slot& slot = *reinterpret_cast<Slot*>(pUserData);
+      if (status == WGPUBufferMapAsyncStatus_Success) {
+        slot.m_state = SlotState::Mapped;
+      }
+      else {
+        std::cout << "Could not map query readback buffer: status " << status << std::endl;
+        slot.m_state = SlotState::Free;
+      }
+      };
+
+    slot.m_state = SlotState::Mapping;
+    wgpuBufferMapAsync(slot.m_buffer, WGPUMapMode_Read, 0, slot.m_size, onBufferMapped, (void*)&slot);
+  }
+
+  uint32_t QueryReadback::oldestMapped() const {
+    // Slots can map out of order, results must be applied in frame order
+    uint32_t oldest = READBACK_FRAMES;
+    for (uint32_t i = 0; i < READBACK_FRAMES; ++i) {
+      const Slot& slot = m_slots[i];
+      if (slot.m_state == SlotState::Mapped && (oldest == READBACK_FRAMES || slot.m_frame < m_slots[oldest].m_frame)) {
+        oldest = i;
+      }
+    }
+    return oldest;
+  }
+
+  const uint64_t* QueryReadback::results(uint32_t slot) const {
+    return reinterpret_cast<const uint64_t*>(
+      wgpuBufferGetConstMappedRange(m_slots[slot].m_buffer, 0, m_slots[slot].m_size));
+  }
+
+  void QueryReadback::release(uint32_t slot) {
+    wgpuBufferUnmap(m_slots[slot].m_buffer);
+    m_slots[slot].m_state = SlotState::Free;
+  }
+
+  void QueryReadback::destroy() {
+    for (Slot& slot : m_slots) {
+      wgpuBufferDestroy(slot.m_buffer);
+      wgpuBufferRelease(slot.m_buffer);
+    }
+    wgpuBufferDestroy(m_resolveBuffer);
+    wgpuBufferRelease(m_resolveBuffer);
+  }
+
+  bool OcclusionQuerySet::create(WGPUDevice device) {
+    WGPUQuerySetDescriptor querySetDesc = {};
+    querySetDesc.nextInChain = nullptr;
+    querySetDesc.label = "Occlusion query set";
+    querySetDesc.type = WGPUQueryType_Occlusion;
+    querySetDesc.count = MAX_OCCLUSION_QUERIES;
+    m_querySet = wgpuDeviceCreateQuerySet(device, &querySetDesc);
+
+    m_readback.create(device, MAX_OCCLUSION_QUERIES, "Occlusion readback buffer");
+
+    for (bool& visible : m_visible) {
+      visible = true;
+    }
+    for (uint64_t& resultFrame : m_resultFrame) {
+      resultFrame = 0;
+    }
+    for (uint32_t& pass : m_lastPass) {
+      pass = 0;
+    }
+    m_pass = 0;
+
+    return true;
+  }
+
+  void OcclusionQuerySet::beginPass() {
+    m_pass++;
+    m_active = false;
+  }
+
+  void OcclusionQuerySet::begin(WGPURenderPassEncoder renderPass, OcclusionQueryHandle handle) {
+    if (handle.id >= MAX_OCCLUSION_QUERIES) {
+      std::cerr << "Invalid occlusion query handle: " << handle.id << std::endl;
+      return;
+    }
+    if (m_active) {
+      std::cerr << "An occlusion query is already active" << std::endl;
+      return;
+    }
+    if (m_lastPass[handle.id] == m_pass) {
+      // Writing a query twice would invalidate the whole pass
+      std::cerr << "Occlusion query " << handle.id << " already used in this pass" << std::endl;
+      return;
+    }
+    m_lastPass[handle.id] = m_pass;
+
+    wgpuRenderPassEncoderBeginOcclusionQuery(renderPass, handle.id);
+    m_issued.push_back(handle.id);
+    m_active = true;
+  }
+
+  void OcclusionQuerySet::end(WGPURenderPassEncoder renderPass) {
+    // The matching begin may have been rejected
+    if (!m_active) {
+      return;
+    }
+
+    wgpuRenderPassEncoderEndOcclusionQuery(renderPass);
+    m_active = false;
+  }
+  void OcclusionQuerySet::endPass(WGPURenderPassEncoder renderPass) {
+    // Ending a pass with an open query is a validation error
+    if (m_active) {
+      std::cerr << "Occlusion query still active at the end of the pass" << std::endl;
+      end(renderPass);
+    }
+  }
+
+  void OcclusionQuerySet::resolve(WGPUCommandEncoder cmdEncoder, uint64_t frame) {
+    if (m_issued.empty()) {
+      return;
+    }
+
+    uint16_t queryCount = 0;
+    for (uint16_t id : m_issued) {
+      if (id >= queryCount) {
+        queryCount = static_cast<uint16_t>(id + 1);
+      }
+    }
+
+    if (m_readback.resolve(cmdEncoder, m_querySet, queryCount, frame)) {
+      m_queries[frame % READBACK_FRAMES].swap(m_issued);
+    }
+    m_issued.clear();
+  }
+
+  void OcclusionQuerySet::readback(uint64_t frame) {
+    m_readback.map(frame);
+  }
+
+  void OcclusionQuerySet::update() {
+    // Apply mapped results oldest frame first, so a newer result always wins
+    for (uint32_t slot = m_readback.oldestMapped(); slot != READBACK_FRAMES; slot = m_readback.oldestMapped()) {
+      const uint64_t frame = m_readback.m_slots[slot].m_frame;
+      const uint64_t* samples = m_readback.results(slot);
+      for (uint16_t id : m_queries[slot]) {
+        // A newer result may already have been applied in an earlier update
+        if (frame + 1 < m_resultFrame[id]) {
+          continue;
+        }
+        m_visible[id] = samples[id] != 0;
+        m_resultFrame[id] = frame + 1;
+      }
+
+      m_readback.release(slot);
+    }
+  }
+
+  bool OcclusionQuerySet::isVisible(OcclusionQueryHandle handle) const {
+    // Unknown handles are never culled
+    if (handle.id >= MAX_OCCLUSION_QUERIES) {
+      return true;
+    }
+    return m_visible[handle.id];
+  }
+
+  void OcclusionQuerySet::destroy() {
+    m_readback.destroy();
+    wgpuQuerySetDestroy(m_querySet);
+    wgpuQuerySetRelease(m_querySet);
+  }
+
+  bool FrameTimer::create(WGPUDevice device, bool timestamps) {
+    m_timestamps = timestamps;
+    if (!m_timestamps) {
+      return true;
+    }
+
+    // A begin and an end timestamp, reused every frame
+    WGPUQuerySetDescriptor querySetDesc = {};
+    querySetDesc.nextInChain = nullptr;
+    querySetDesc.label = "Frame timer query set";
+    querySetDesc.type = WGPUQueryType_Timestamp;
+    querySetDesc.count = 2;
+    m_querySet = wgpuDeviceCreateQuerySet(device, &querySetDesc);
+
+    m_readback.create(device, 2, "Frame timer readback buffer");
+
+    return true;
+  }
+
+  const WGPURenderPassTimestampWrite* FrameTimer::beginWrite() {
+    // Only the first default pass of the frame starts the timing
+    if (!m_timestamps || m_begun) {
+      return nullptr;
+    }
+
+    m_begun = true;
+    m_write.querySet = m_querySet;
+    m_write.queryIndex = 0;
+    m_write.location = WGPURenderPassTimestampLocation_Beginning;
+    return &m_write;
+  }
+
+  const WGPURenderPassTimestampWrite* FrameTimer::endWrite() {
+    if (!m_timestamps || !m_begun) {
+      return nullptr;
+    }
+
+    m_ended = true;
+    m_write.querySet = m_querySet;
+    m_write.queryIndex = 1;
+    m_write.location = WGPURenderPassTimestampLocation_End;
+    return &m_write;
+  }
+
+  void FrameTimer::resolve(WGPUCommandEncoder cmdEncoder, uint64_t frame) {
+    // No end timestamp means no sample this frame
+    if (m_begun && m_ended) {
+      m_readback.resolve(cmdEncoder, m_querySet, 2, frame);
+    }
+    m_begun = false;
+    m_ended = false;
+  }
+
+  void FrameTimer::readback(uint64_t frame) {
+    if (m_timestamps) {
+      m_readback.map(frame);
+    }
+  }
+
+  bool FrameTimer::consume(FrameFence& fence, float& gpuTimeMs) {
+    if (m_timestamps) {
+      for (uint32_t slot = m_readback.oldestMapped(); slot != READBACK_FRAMES; slot = m_readback.oldestMapped()) {
+        const uint64_t* timestamps = m_readback.results(slot);
+        // Timestamps are in nanoseconds
+        if (timestamps[1] > timestamps[0]) {
+          addSample(static_cast<float>(timestamps[1] - timestamps[0]) * 1e-6f);
+        }
+        m_readback.release(slot);
+      }
+    }
+    else {
+      float elapsedMs;
+      if (fence.consumeElapsed(elapsedMs)) {
+        addSample(elapsedMs);
+      }
+    }
+
+    if (!m_hasSample) {
+      return false;
+    }
+
+    gpuTimeMs = m_gpuTimeMs;
+    m_hasSample = false;
+    return true;
+  }
+
+  void FrameTimer::destroy() {
+    if (!m_timestamps) {
+      return;
+    }
+
+    m_readback.destroy();
+    wgpuQuerySetDestroy(m_querySet);
+    wgpuQuerySetRelease(m_querySet);
+  }
+
+  void FrameTimer::addSample(float gpuTimeMs) {
+    // Keep the worst frame until the sample is consumed
+    if (gpuTimeMs < 0.0f) {
+      gpuTimeMs = 0.0f;
+    }
+    if (!m_hasSample || gpuTimeMs > m_gpuTimeMs) {
+      m_gpuTimeMs = gpuTimeMs;
+    }
+    m_hasSample = true;
+  }
+
+  void ResolutionController::init(const DynamicResolution& desc) {
+    // Written so NaN fails the checks too, and falls back to the defaults
+    const DynamicResolution defaults;
+    m_minScale = desc.minScale > 0.0f ? desc.minScale : defaults.minScale;
+    m_maxScale = desc.maxScale > 0.0f ? desc.maxScale : defaults.maxScale;
+    if (m_minScale > 1.0f) m_minScale = 1.0f;
+    if (m_maxScale > 1.0f) m_maxScale = 1.0f;
+    if (m_minScale > m_maxScale) m_minScale = m_maxScale;
+    if (m_minScale != desc.minScale || m_maxScale != desc.maxScale) {
+      std::cerr << "Dynamic resolution scales must be in (0, 1] with min <= max, using "
+        << m_minScale << " to " << m_maxScale << std::endl;
+    }
+
+    m_budgetMs = desc.frameBudgetMs > 0.0f && desc.frameBudgetMs < FLT_MAX ? desc.frameBudgetMs : defaults.frameBudgetMs;
+    if (m_budgetMs != desc.frameBudgetMs) {
+      std::cerr << "Dynamic resolution frame budget must be positive, using " << m_budgetMs << " ms" << std::endl;
+    }
+
+    m_scale = m_maxScale;
+    m_smoothedMs = 0.0f;
+  }
+
+  void ResolutionController::update(float gpuTimeMs) {
+    if (!(gpuTimeMs > 0.0f && gpuTimeMs < FLT_MAX)) {
+      return;
+    }
+
+    m_smoothedMs = m_smoothedMs > 0.0f ? m_smoothedMs + (gpuTimeMs - m_smoothedMs) * 0.25f : gpuTimeMs;
+
+    // GPU cost follows the pixel count, i.e. the square of the scale
+    if (gpuTimeMs > m_budgetMs) {
+      // React to spikes right away, without waiting for the average
+      const float frameMs = gpuTimeMs > m_smoothedMs ? gpuTimeMs : m_smoothedMs;
+      m_scale *= std::sqrt(m_budgetMs / frameMs);
+    }
+    else if (m_smoothedMs < m_budgetMs * 0.85f) {
+      const float target = m_scale * std::sqrt(m_budgetMs / m_smoothedMs);
+      m_scale = target < m_scale + 0.02f ? target : m_scale + 0.02f;
+    }
+
+    if (m_scale < m_minScale) {
+      m_scale = m_minScale;
+    }
+    if (m_scale > m_maxScale) {
+      m_scale = m_maxScale;
+    }
+  }
+
+  bool UpscalePass::create(WGPUDevice device, Resolution resolution) {
+    m_resolution = resolution;
+    m_width = resolution.width;
+    m_height = resolution.height;
+
+    // Same format as the swap chain so that user pipelines work on both
+    WGPUTextureDescriptor textureDesc = {};
+    textureDesc.nextInChain = nullptr;
+    textureDesc.label = "Upscale source texture";
+    textureDesc.usage = WGPUTextureUsage_RenderAttachment | WGPUTextureUsage_TextureBinding;
+    textureDesc.dimension = WGPUTextureDimension_2D;
+    textureDesc.size = { resolution.width, resolution.height, 1 };
+    textureDesc.format = WGPUTextureFormat_BGRA8Unorm;
+    textureDesc.mipLevelCount = 1;
+    textureDesc.sampleCount = 1;
+    textureDesc.viewFormatCount = 0;
+    textureDesc.viewFormats = nullptr;
+    m_texture = wgpuDeviceCreateTexture(device, &textureDesc);
+
+    WGPUTextureViewDescriptor viewDesc = {};
+    viewDesc.nextInChain = nullptr;
+    viewDesc.label = "Upscale source view";
+    viewDesc.format = textureDesc.format;
+    viewDesc.dimension = WGPUTextureViewDimension_2D;
+    viewDesc.baseMipLevel = 0;
+    viewDesc.mipLevelCount = 1;
+    viewDesc.baseArrayLayer = 0;
+    viewDesc.arrayLayerCount = 1;
+    viewDesc.aspect = WGPUTextureAspect_All;
+    m_textureView = wgpuTextureCreateView(m_texture, &viewDesc);
+
+    WGPUSamplerDescriptor samplerDesc = {};
+    samplerDesc.nextInChain = nullptr;
+    samplerDesc.label = "Upscale sampler";
+    samplerDesc.addressModeU = WGPUAddressMode_ClampToEdge;
+    samplerDesc.addressModeV = WGPUAddressMode_ClampToEdge;
+    samplerDesc.addressModeW = WGPUAddressMode_ClampToEdge;
+    samplerDesc.magFilter = WGPUFilterMode_Linear;
+    samplerDesc.minFilter = WGPUFilterMode_Linear;
+    samplerDesc.mipmapFilter = WGPUMipmapFilterMode_Nearest;
+    samplerDesc.lodMinClamp = 0.0f;
+    samplerDesc.lodMaxClamp = 1.0f;
+    samplerDesc.compare = WGPUCompareFunction_Undefined;
+    samplerDesc.maxAnisotropy = 1;
+    m_sampler = wgpuDeviceCreateSampler(device, &samplerDesc);
+
+    WGPUBufferDescriptor bufferDesc = {};
+    bufferDesc.nextInChain = nullptr;
+    bufferDesc.label = "Upscale params";
+    bufferDesc.usage = WGPUBufferUsage_Uniform | WGPUBufferUsage_CopyDst;
+    bufferDesc.size = 4 * sizeof(float);
+    bufferDesc.mappedAtCreation = false;
+    m_params = wgpuDeviceCreateBuffer(device, &bufferDesc);
+
+    Memory shaderMem;
+    shaderMem.data = reinterpret_cast<const uint8_t*>(s_upscaleShader);
+    shaderMem.size = strlen(s_upscaleShader);
+    m_shader.create(device, shaderMem);
+    m_pipeline.create(device, m_shader.m_shaderModule, nullptr, DepthMode::NoAttachment, true);
+
+    WGPUBindGroupEntry entries[3] = {};
+    entries[0].binding = 0;
+    entries[0].textureView = m_textureView;
+    entries[1].binding = 1;
+    entries[1].sampler = m_sampler;
+    entries[2].binding = 2;
+    entries[2].buffer = m_params;
+    entries[2].offset = 0;
+    entries[2].size = bufferDesc.size;
+
+    WGPUBindGroupLayout layout = wgpuRenderPipelineGetBindGroupLayout(m_pipeline.m_renderPipeline, 0);
+
+    WGPUBindGroupDescriptor bindGroupDesc = {};
+    bindGroupDesc.nextInChain = nullptr;
+    bindGroupDesc.label = "Upscale bind group";
+    bindGroupDesc.layout = layout;
+    bindGroupDesc.entryCount = 3;
+    bindGroupDesc.entries = entries;
+    m_bindGroup = wgpuDeviceCreateBindGroup(device, &bindGroupDesc);
+
+    wgpuBindGroupLayoutRelease(layout);
+
+    return true;
+  }
+
+  void UpscalePass::setScale(float scale) {
+    // Converting NaN to an integer is undefined
+    if (!(scale > 0.0f)) scale = 1.0f;
+    if (scale > 1.0f) scale = 1.0f;
+    m_width = static_cast<uint32_t>(static_cast<float>(m_resolution.width) * scale + 0.5f);
+    m_height = static_cast<uint32_t>(static_cast<float>(m_resolution.height) * scale + 0.5f);
+    if (m_width < 1) m_width = 1;
+    if (m_height < 1) m_height = 1;
+    if (m_width > m_resolution.width) m_width = m_resolution.width;
+    if (m_height > m_resolution.height) m_height = m_resolution.height;
+  }
+
+  void UpscalePass::execute(WGPUCommandEncoder cmdEncoder, WGPUQueue queue, WGPUTextureView target, const WGPURenderPassTimestampWrite* timestampWrite) {
+    const float width = static_cast<float>(m_resolution.width);
+    const float height = static_cast<float>(m_resolution.height);
+    const float scaledWidth = static_cast<float>(m_width);
+    const float scaledHeight = static_cast<float>(m_height);
+
+    // Only sample the rendered region, clamped half a texel in so that
+    // filtering does not pick up stale texels outside of it
+    float params[4] = {
+      scaledWidth / width,
+      scaledHeight / height,
+      (scaledWidth - 0.5f) / width,
+      (scaledHeight - 0.5f) / height
+    };
+    wgpuQueueWriteBuffer(queue, m_params, 0, params, sizeof(params));
+
+    WGPURenderPassColorAttachment colorAttachment = {};
+    colorAttachment.view = target;
+    colorAttachment.resolveTarget = nullptr;
+    colorAttachment.loadOp = WGPULoadOp_Clear;
+    colorAttachment.storeOp = WGPUStoreOp_Store;
+    colorAttachment.clearValue = WGPUColor{ 0.0, 0.0, 0.0, 1.0 };
+
+    WGPURenderPassDescriptor renderPassDesc = {};
+    renderPassDesc.colorAttachmentCount = 1;
+    renderPassDesc.colorAttachments = &colorAttachment;
+    renderPassDesc.depthStencilAttachment = nullptr;
+    renderPassDesc.timestampWriteCount = timestampWrite ? 1 : 0;
+    renderPassDesc.timestampWrites = timestampWrite;
+    renderPassDesc.nextInChain = nullptr;
+
+    WGPURenderPassEncoder renderPass = wgpuCommandEncoderBeginRenderPass(cmdEncoder, &renderPassDesc);
+    wgpuRenderPassEncoderSetPipeline(renderPass, m_pipeline.m_renderPipeline);
+    wgpuRenderPassEncoderSetBindGroup(renderPass, 0, m_bindGroup, 0, nullptr);
+    wgpuRenderPassEncoderDraw(renderPass, 3, 1, 0, 0);
+    wgpuRenderPassEncoderEnd(renderPass);
+    wgpuRenderPassEncoderRelease(renderPass);
+  }
+
+  void UpscalePass::destroy() {
+    wgpuBindGroupRelease(m_bindGroup);
+    wgpuRenderPipelineRelease(m_pipeline.m_renderPipeline);
+    wgpuShaderModuleRelease(m_shader.m_shaderModule);
+    wgpuBufferDestroy(m_params);
+    wgpuBufferRelease(m_params);
+    wgpuSamplerRelease(m_sampler);
+    wgpuTextureViewRelease(m_textureView);
+    wgpuTextureDestroy(m_texture);
+    wgpuTextureRelease(m_texture);
+  }
+
+  bool MaterialTable::create(WGPUDevice device, WGPUQueue queue) {
+    WGPUBufferDescriptor bufferDesc = {};
+    bufferDesc.nextInChain = nullptr;
+    bufferDesc.label = "Material params";
+    bufferDesc.usage = WGPUBufferUsage_Storage | WGPUBufferUsage_CopyDst;
+    bufferDesc.size = MAX_MATERIALS * sizeof(Params);
+    bufferDesc.mappedAtCreation = false;
+    m_params = wgpuDeviceCreateBuffer(device, &bufferDesc);
+
+    WGPUTextureDescriptor textureDesc = {};
+    textureDesc.nextInChain = nullptr;
+    textureDesc.label = "Material textures";
+    textureDesc.usage = WGPUTextureUsage_TextureBinding | WGPUTextureUsage_CopyDst;
+    textureDesc.dimension = WGPUTextureDimension_2D;
+    textureDesc.size = { materialTextureSize, materialTextureSize, MAX_MATERIAL_LAYERS };
+    textureDesc.format = WGPUTextureFormat_RGBA8Unorm;
+    textureDesc.mipLevelCount = 1;
+    textureDesc.sampleCount = 1;
+    textureDesc.viewFormatCount = 0;
+    textureDesc.viewFormats = nullptr;
+    m_texture = wgpuDeviceCreateTexture(device, &textureDesc);
+
+    WGPUTextureViewDescriptor viewDesc = {};
+    viewDesc.nextInChain = nullptr;
+    viewDesc.label = "Material textures view";
+    viewDesc.format = textureDesc.format;
+    viewDesc.dimension = WGPUTextureViewDimension_2DArray;
+    viewDesc.baseMipLevel = 0;
+    viewDesc.mipLevelCount = 1;
+    viewDesc.baseArrayLayer = 0;
+    viewDesc.arrayLayerCount = MAX_MATERIAL_LAYERS;
+    viewDesc.aspect = WGPUTextureAspect_All;
+    m_textureView = wgpuTextureCreateView(m_texture, &viewDesc);
+
+    WGPUSamplerDescriptor samplerDesc = {};
+    samplerDesc.nextInChain = nullptr;
+    samplerDesc.label = "Material sampler";
+    samplerDesc.addressModeU = WGPUAddressMode_Repeat;
+    samplerDesc.addressModeV = WGPUAddressMode_Repeat;
+    samplerDesc.addressModeW = WGPUAddressMode_ClampToEdge;
+    samplerDesc.magFilter = WGPUFilterMode_Linear;
+    samplerDesc.minFilter = WGPUFilterMode_Linear;
+    samplerDesc.mipmapFilter = WGPUMipmapFilterMode_Nearest;
+    samplerDesc.lodMinClamp = 0.0f;
+    samplerDesc.lodMaxClamp = 1.0f;
+    samplerDesc.compare = WGPUCompareFunction_Undefined;
+    samplerDesc.maxAnisotropy = 1;
+    m_sampler = wgpuDeviceCreateSampler(device, &samplerDesc);
+
+    WGPUBindGroupLayoutEntry layoutEntries[3] = {};
+    layoutEntries[0].binding = 0;
+    layoutEntries[0].visibility = WGPUShaderStage_Vertex | WGPUShaderStage_Fragment;
+    layoutEntries[0].buffer.type = WGPUBufferBindingType_ReadOnlyStorage;
+    layoutEntries[0].buffer.minBindingSize = sizeof(Params);
+    layoutEntries[1].binding = 1;
+    layoutEntries[1].visibility = WGPUShaderStage_Fragment;
+    layoutEntries[1].texture.sampleType = WGPUTextureSampleType_Float;
+    layoutEntries[1].texture.viewDimension = WGPUTextureViewDimension_2DArray;
+    layoutEntries[2].binding = 2;
+    layoutEntries[2].visibility = WGPUShaderStage_Fragment;
+    layoutEntries[2].sampler.type = WGPUSamplerBindingType_Filtering;
+
+    WGPUBindGroupLayoutDescriptor bindGroupLayoutDesc = {};
+    bindGroupLayoutDesc.nextInChain = nullptr;
+    bindGroupLayoutDesc.label = "Material table layout";
+    bindGroupLayoutDesc.entryCount = 3;
+    bindGroupLayoutDesc.entries = layoutEntries;
+    m_bindGroupLayout = wgpuDeviceCreateBindGroupLayout(device, &bindGroupLayoutDesc);
+
+    WGPUPipelineLayoutDescriptor pipelineLayoutDesc = {};
+    pipelineLayoutDesc.nextInChain = nullptr;
+    pipelineLayoutDesc.label = "Material table pipeline layout";
+    pipelineLayoutDesc.bindGroupLayoutCount = 1;
+    pipelineLayoutDesc.bindGroupLayouts = &m_bindGroupLayout;
+    m_pipelineLayout = wgpuDeviceCreatePipelineLayout(device, &pipelineLayoutDesc);
+
+    WGPUBindGroupEntry entries[3] = {};
+    entries[0].binding = 0;
+    entries[0].buffer = m_params;
+    entries[0].offset = 0;
+    entries[0].size = bufferDesc.size;
+    entries[1].binding = 1;
+    entries[1].textureView = m_textureView;
+    entries[2].binding = 2;
+    entries[2].sampler = m_sampler;
+
+    WGPUBindGroupDescriptor bindGroupDesc = {};
+    bindGroupDesc.nextInChain = nullptr;
+    bindGroupDesc.label = "Material table bind group";
+    bindGroupDesc.layout = m_bindGroupLayout;
+    bindGroupDesc.entryCount = 3;
+    bindGroupDesc.entries = entries;
+    m_bindGroup = wgpuDeviceCreateBindGroup(device, &bindGroupDesc);
+
+    // Layer 0 is plain white, for materials without a texture
+    std::vector<uint8_t> white(materialTextureSize * materialTextureSize * 4, 0xFF);
+    WGPUImageCopyTexture destination = {};
+    destination.nextInChain = nullptr;
+    destination.texture = m_texture;
+    destination.mipLevel = 0;
+    destination.origin = { 0, 0, 0 };
+    destination.aspect = WGPUTextureAspect_All;
+
+    WGPUTextureDataLayout source = {};
+    source.nextInChain = nullptr;
+    source.offset = 0;
+    source.bytesPerRow = materialTextureSize * 4;
+    source.rowsPerImage = materialTextureSize;
+
+    WGPUExtent3D size = { materialTextureSize, materialTextureSize, 1 };
+    wgpuQueueWriteTexture(queue, &destination, white.data(), white.size(), &source, &size);
+
+    m_created = true;
+
+    return true;
+  }
+
+  void MaterialTable::write(WGPUQueue queue, MaterialHandle handle, const MaterialDesc& desc) {
+    Params params = {};
+    for (int i = 0; i < 4; ++i) {
+      params.baseColor[i] = desc.baseColor[i];
+    }
+    // Texture handle ids start after the white layer
+    params.textureLayer = desc.albedo.id == nullHandle ? 0 : uint32_t(desc.albedo.id) + 1;
+    m_materialLayers[handle.id] = params.textureLayer;
+    m_layerRefs[params.textureLayer]++;
+
+    wgpuQueueWriteBuffer(queue, m_params, handle.id * sizeof(Params), &params, sizeof(Params));
+  }
+
+  void MaterialTable::writeTexture(WGPUQueue queue, MaterialTextureHandle handle, const uint8_t* data) {
+    const uint64_t layerSize = uint64_t(materialTextureSize) * materialTextureSize * 4;
+
+    WGPUImageCopyTexture destination = {};
+    destination.nextInChain = nullptr;
+    destination.texture = m_texture;
+    destination.mipLevel = 0;
+    destination.origin = { 0, 0, uint32_t(handle.id) + 1 };
+    destination.aspect = WGPUTextureAspect_All;
+
+    WGPUTextureDataLayout source = {};
+    source.nextInChain = nullptr;
+    source.offset = 0;
+    source.bytesPerRow = materialTextureSize * 4;
+    source.rowsPerImage = materialTextureSize;
+
+    WGPUExtent3D size = { materialTextureSize, materialTextureSize, 1 };
+    wgpuQueueWriteTexture(queue, &destination, data, static_cast<size_t>(layerSize), &source, &size);
+  }
+
+  void MaterialTable::release(MaterialHandle handle) {
+    m_layerRefs[m_materialLayers[handle.id]]--;
+  }
+
+  bool MaterialTable::isTextureUsed(MaterialTextureHandle handle) const {
+    return m_layerRefs[uint32_t(handle.id) + 1] != 0;
   }
 
-  void Buffer::destroy() {
-    wgpuBufferDestroy(m_buffer);
-    wgpuBufferRelease(m_buffer);
+  void MaterialTable::destroy() {
+    wgpuBindGroupRelease(m_bindGroup);
+    wgpuPipelineLayoutRelease(m_pipelineLayout);
+    wgpuBindGroupLayoutRelease(m_bindGroupLayout);
+    wgpuSamplerRelease(m_sampler);
+    wgpuTextureViewRelease(m_textureView);
+    wgpuTextureDestroy(m_texture);
+    wgpuTextureRelease(m_texture);
+    wgpuBufferDestroy(m_params);
+    wgpuBufferRelease(m_params);
+    m_created = false;
   }
 }
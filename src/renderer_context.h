@@ -1,6 +1,8 @@
 #pragma once
 
 #include <webgpu/webgpu.h>
+#include <chrono>
+#include <deque>
 #include <vector>
 
 #include "octogfx/octogfx.h"
@@ -9,6 +11,12 @@ constexpr uint32_t MAX_PASSES = 512;
 constexpr uint32_t MAX_PIPELINES = 512;
 constexpr uint32_t MAX_SHADERS = 512;
 constexpr uint32_t MAX_BUFFERS = 4 << 10;
+constexpr uint32_t MAX_OCCLUSION_QUERIES = 4 << 10;
+constexpr uint32_t READBACK_FRAMES = 3;
+constexpr uint32_t TRANSIENT_BUFFER_MAX_IDLE_FRAMES = 120;
+constexpr uint32_t MAX_MATERIALS = 4 << 10;
+constexpr uint32_t MAX_MATERIAL_LAYERS = 256;
+constexpr WGPUTextureFormat DEPTH_FORMAT = WGPUTextureFormat_Depth24Plus;
 
 namespace ogfx {
   struct InitInfo;
@@ -21,36 +29,320 @@ namespace ogfx {
   //  WGPURenderPassEncoder m_renderPass;
   //};
 
-  struct RenderPipeline {
-    bool create(WGPUDevice device, WGPUShaderModule shaderModule);
+  // Resources released during a frame are kept alive until the frame fence
+  // reports that the work submitted for that frame has completed. Transient
+  // buffers go back to a pool instead and can be reused from then on.
+  struct DeletionQueue {
+    struct TransientBuffer {
+      WGPUBuffer m_buffer;
+      WGPUBufferUsageFlags m_usage;
+      uint64_t m_size; // allocated size, may exceed the requested one
+      uint64_t m_lastFrame;
+    };
+
+    void push(WGPUBuffer buffer, uint64_t frame);
+    void push(WGPUTexture texture, uint64_t frame);
+    void push(WGPUTextureView textureView, uint64_t frame);
+    void push(WGPUBindGroup bindGroup, uint64_t frame);
+    void push(WGPURenderPipeline renderPipeline, uint64_t frame);
+    void push(WGPUShaderModule shaderModule, uint64_t frame);
+    void pushTransient(WGPUBuffer buffer, WGPUBufferUsageFlags usage, uint64_t size, uint64_t frame);
+    // Gives a freed handle id back to its allocator
+    typedef void (*RecycleFn)(void* allocator, uint16_t id);
+    void push(RecycleFn recycle, void* allocator, uint16_t id, uint64_t frame);
+    TransientBuffer acquireTransient(WGPUDevice device, WGPUBufferUsageFlags usage, uint64_t size);
+    void collect(uint64_t frame, uint64_t completedFrames);
+    void flush();
+
+    enum class ResourceType { Buffer, TransientBuffer, Texture, TextureView, BindGroup, RenderPipeline, ShaderModule, HandleId };
+
+    struct Entry {
+      ResourceType m_type;
+      uint64_t m_frame;
+      union {
+        WGPUBuffer m_buffer;
+        WGPUTexture m_texture;
+        WGPUTextureView m_textureView;
+        WGPUBindGroup m_bindGroup;
+        WGPURenderPipeline m_renderPipeline;
+        WGPUShaderModule m_shaderModule;
+        void* m_allocator;
+      };
+      WGPUBufferUsageFlags m_usage;
+      uint64_t m_size;
+      RecycleFn m_recycle;
+      uint16_t m_id;
+    };
+
+    std::deque<Entry> m_entries;
+    std::vector<TransientBuffer> m_transientBuffers;
+
+  private:
+    void release(const Entry& entry);
+  };
+
+  // One queue work done notification per submitted frame, shared by everything
+  // that waits on the GPU. Also measures the time from submit to notification,
+  // minus the time the CPU spent blocked on acquire/present, as a fallback GPU
+  // frame time. Notifications are only seen when the device is polled, so that
+  // time remains an upper bound.
+  struct FrameFence {
+    using Clock = std::chrono::steady_clock;
+
+    void submit(WGPUQueue queue, uint64_t frame);
+    void addBlocked(Clock::duration duration);
+    bool consumeElapsed(float& elapsedMs);
+
+    struct Submit {
+      uint64_t m_frame;
+      Clock::time_point m_time;
+      Clock::duration m_blocked;
+    };
+
+    std::deque<Submit> m_submits;
+    uint64_t m_completedFrames = 0; // every frame below this one is done on the GPU
+    Clock::duration m_blocked = Clock::duration::zero(); // total so far
+    float m_elapsedMs = 0.0f; // worst frame since last consumed
+    bool m_hasElapsed = false;
+  };
+
+  // Query results resolved every frame and read back through a ring of
+  // mappable buffers, so the CPU never waits on the GPU for them. A frame's
+  // results are dropped if its slot is still in use.
+  struct QueryReadback {
+    bool create(WGPUDevice device, uint32_t queryCount, const char* label);
+    bool resolve(WGPUCommandEncoder cmdEncoder, WGPUQuerySet querySet, uint32_t queryCount, uint64_t frame);
+    void map(uint64_t frame);
+    uint32_t oldestMapped() const; // READBACK_FRAMES if none
+    const uint64_t* results(uint32_t slot) const;
+    void release(uint32_t slot);
     void destroy();
 
+    enum class SlotState { Free, Resolved, Mapping, Mapped };
+
+    struct Slot {
+      WGPUBuffer m_buffer;
+      uint64_t m_size = 0;
+      uint64_t m_frame = 0;
+      SlotState m_state = SlotState::Free;
+    };
+
+    WGPUBuffer m_resolveBuffer;
+    Slot m_slots[READBACK_FRAMES];
+  };
+
+  // How a pipeline uses the depth attachment of the pass it is drawn in
+  enum class DepthMode {
+    NoAttachment, // the pass has no depth attachment
+    Ignore,       // always passes, leaves depth untouched
+    TestWrite,
+    TestOnly
+  };
+
+  struct RenderPipeline {
+    bool create(WGPUDevice device, WGPUShaderModule shaderModule, WGPUPipelineLayout layout, DepthMode depthMode, bool colorWrites);
+    void destroy(DeletionQueue& deletionQueue, uint64_t frame);
+
     WGPURenderPipeline m_renderPipeline;
+    bool m_materialTable = false;
   };
 
   struct Shader {
     bool create(WGPUDevice device, Memory mem);
-    void destroy();
+    void destroy(DeletionQueue& deletionQueue, uint64_t frame);
 
     WGPUShaderModule m_shaderModule;
   };
 
   struct Buffer {
     bool create(WGPUDevice device);
+    bool createTransient(WGPUDevice device, DeletionQueue& deletionQueue, uint64_t size);
     void write(WGPUQueue queue, Memory mem);
-    void destroy();
+    void destroy(DeletionQueue& deletionQueue, uint64_t frame);
 
     WGPUBuffer m_buffer;
+    WGPUBufferUsageFlags m_usage;
+    uint64_t m_size;
+    bool m_transient = false;
   };
 
-  template<typename T>
+  // Occlusion results are read back a few frames late, the last known result
+  // of each query is kept until a newer one arrives.
+  struct OcclusionQuerySet {
+    bool create(WGPUDevice device);
+    void beginPass();
+    void begin(WGPURenderPassEncoder renderPass, OcclusionQueryHandle handle);
+    void end(WGPURenderPassEncoder renderPass);
+    void endPass(WGPURenderPassEncoder renderPass);
+    void resolve(WGPUCommandEncoder cmdEncoder, uint64_t frame);
+    void readback(uint64_t frame);
+    void update();
+    bool isVisible(OcclusionQueryHandle handle) const;
+    void destroy();
+
+    WGPUQuerySet m_querySet = nullptr;
+    QueryReadback m_readback;
+    std::vector<uint16_t> m_queries[READBACK_FRAMES]; // issued in the frame of each readback slot
+    std::vector<uint16_t> m_issued;
+    bool m_visible[MAX_OCCLUSION_QUERIES];
+    uint64_t m_resultFrame[MAX_OCCLUSION_QUERIES]; // frame + 1 of the result in m_visible
+    uint32_t m_lastPass[MAX_OCCLUSION_QUERIES]; // a query may only be written once per pass
+    uint32_t m_pass = 0;
+    bool m_active = false;
+  };
+
+  // GPU time of each frame. With timestamp queries, timestamps are written at
+  // the start of the default pass and the end of the upscale pass. Without
+  // them, it falls back to the time measured by the frame fence.
+  struct FrameTimer {
+    bool create(WGPUDevice device, bool timestamps);
+    const WGPURenderPassTimestampWrite* beginWrite();
+    const WGPURenderPassTimestampWrite* endWrite();
+    void resolve(WGPUCommandEncoder cmdEncoder, uint64_t frame);
+    void readback(uint64_t frame);
+    bool consume(FrameFence& fence, float& gpuTimeMs);
+    void destroy();
+
+    bool m_timestamps = false;
+    WGPUQuerySet m_querySet = nullptr;
+    QueryReadback m_readback;
+    WGPURenderPassTimestampWrite m_write;
+    bool m_begun = false;
+    bool m_ended = false;
+
+    float m_gpuTimeMs = 0.0f;
+    bool m_hasSample = false;
+
+  private:
+    void addSample(float gpuTimeMs);
+  };
+
+  // Drives the render scale towards a GPU frame time budget: drops quickly when
+  // over budget, recovers slowly once comfortably under it.
+  struct ResolutionController {
+    void init(const DynamicResolution& desc);
+    void update(float gpuTimeMs);
+
+    float m_scale = 1.0f;
+    float m_minScale = 1.0f;
+    float m_maxScale = 1.0f;
+    float m_budgetMs = 0.0f;
+    float m_smoothedMs = 0.0f;
+  };
+
+  // Offscreen target the default pass renders into at a fraction of the output
+  // resolution, and the blit that upscales it into the swap chain.
+  struct UpscalePass {
+    bool create(WGPUDevice device, Resolution resolution);
+    void setScale(float scale);
+    void execute(WGPUCommandEncoder cmdEncoder, WGPUQueue queue, WGPUTextureView target, const WGPURenderPassTimestampWrite* timestampWrite);
+    void destroy();
+
+    Resolution m_resolution;
+    uint32_t m_width;
+    uint32_t m_height;
+    WGPUTexture m_texture;
+    WGPUTextureView m_textureView;
+    WGPUSampler m_sampler;
+    WGPUBuffer m_params;
+    WGPUBindGroup m_bindGroup;
+    Shader m_shader;
+    RenderPipeline m_pipeline;
+  };
+
+  // All material parameters live in one storage buffer and all material
+  // textures in one texture array, so draws that only differ by material share
+  // the same bind group and can be batched together.
+  struct MaterialTable {
+    bool create(WGPUDevice device, WGPUQueue queue);
+    void write(WGPUQueue queue, MaterialHandle handle, const MaterialDesc& desc);
+    void writeTexture(WGPUQueue queue, MaterialTextureHandle handle, const uint8_t* data);
+    void release(MaterialHandle handle);
+    bool isTextureUsed(MaterialTextureHandle handle) const;
+    void destroy();
+
+    // Matches the WGSL layout of struct Material
+    struct Params {
+      float baseColor[4];
+      uint32_t textureLayer;
+      uint32_t padding[3];
+    };
+
+    WGPUBuffer m_params;
+    WGPUTexture m_texture;
+    WGPUTextureView m_textureView;
+    WGPUSampler m_sampler;
+    WGPUBindGroupLayout m_bindGroupLayout;
+    WGPUPipelineLayout m_pipelineLayout;
+    WGPUBindGroup m_bindGroup;
+    uint32_t m_materialLayers[MAX_MATERIALS] = {};
+    uint32_t m_layerRefs[MAX_MATERIAL_LAYERS] = {}; // materials using each layer
+    bool m_created = false;
+  };
+
+  template<typename T, uint32_t N>
   struct HandleAllocator {
-    inline void allocate(T& handle) {
-      handle.id = m_currentId++;
+    // Leaves the handle null once all N ids are in use
+    inline bool allocate(T& handle) {
+      if (!m_freeIds.empty()) {
+        handle.id = m_freeIds.back();
+        m_freeIds.pop_back();
+      }
+      else if (m_currentId < N) {
+        handle.id = m_currentId++;
+      }
+      else {
+        handle.id = nullHandle;
+        return false;
+      }
+      handle.generation = m_generations[handle.id];
+      m_alive[handle.id] = true;
+      return true;
+    }
+
+    inline bool isValid(T handle) const {
+      return handle.id < N && m_alive[handle.id] && m_generations[handle.id] == handle.generation;
+    }
+
+    // Freeing a stale handle again must not hand its id out twice
+    inline bool free(T handle) {
+      if (!retire(handle)) {
+        return false;
+      }
+      m_freeIds.push_back(handle.id);
+      return true;
+    }
+
+    // The handle is invalid right away, but its id is only reused once the
+    // GPU is done with the frame, for ids that index GPU-side data
+    inline bool free(T handle, DeletionQueue& deletionQueue, uint64_t frame) {
+      if (!retire(handle)) {
+        return false;
+      }
+      deletionQueue.push(&HandleAllocator::recycle, this, handle.id, frame);
+      return true;
     }
 
   private:
+    inline bool retire(T handle) {
+      if (!isValid(handle)) {
+        return false;
+      }
+      m_alive[handle.id] = false;
+      // Handles still holding this id no longer match the slot
+      m_generations[handle.id]++;
+      return true;
+    }
+
+    static void recycle(void* allocator, uint16_t id) {
+      static_cast<HandleAllocator*>(allocator)->m_freeIds.push_back(id);
+    }
+
+
     uint16_t m_currentId = 0;
+    std::vector<uint16_t> m_freeIds;
+    bool m_alive[N] = {};
+    uint16_t m_generations[N] = {};
   };
 
   struct RendererContext {
@@ -60,13 +352,29 @@ namespace ogfx {
     RenderPipelineHandle newRenderPipeline(const RenderPipelineDesc& desc);
     ShaderHandle newShader(Memory mem);
     BufferHandle newBuffer(Memory mem);
+    BufferHandle newTransientBuffer(Memory mem);
+    OcclusionQueryHandle newOcclusionQuery();
+    MaterialHandle newMaterial(const MaterialDesc& desc);
+    MaterialTextureHandle newMaterialTexture(Memory mem);
+
+    void destroyRenderPipeline(RenderPipelineHandle handle);
+    void destroyShader(ShaderHandle handle);
+    void destroyBuffer(BufferHandle handle);
+    void destroyMaterial(MaterialHandle handle);
+    void destroyMaterialTexture(MaterialTextureHandle handle);
 
     void beginDefaultPass();
     void endPass();
     void applyPipeline(RenderPipelineHandle handle);
     void draw();
+    void draw(MaterialHandle material);
+    void beginOcclusionQuery(OcclusionQueryHandle handle);
+    void endOcclusionQuery();
+    bool isVisible(OcclusionQueryHandle handle);
     void commitFrame();
 
+    float getResolutionScale();
+
   private:
     WGPUInstance m_instance;
     WGPUSurface m_surface;
@@ -76,15 +384,32 @@ namespace ogfx {
     WGPUQueue m_queue;
     WGPUSwapChain m_swapChain;
     WGPUCommandEncoder m_cmdEncoder;
-    WGPUTextureView m_nextTexture;
+    WGPUTextureView m_nextTexture = nullptr;
+    WGPUTexture m_depthTexture;
+    WGPUTextureView m_depthTextureView;
+    bool m_dynamicResolution;
 
     WGPURenderPassEncoder m_currentRenderPass;
+    bool m_materialTableBound;
+    uint64_t m_frame = 0;
 
     RenderPipeline m_renderPipelines[MAX_PIPELINES];
-    HandleAllocator<RenderPipelineHandle> m_renderPipelineAlloc;
+    HandleAllocator<RenderPipelineHandle, MAX_PIPELINES> m_renderPipelineAlloc;
     Shader m_shaders[MAX_SHADERS];
-    HandleAllocator<ShaderHandle> m_shaderAlloc;
+    HandleAllocator<ShaderHandle, MAX_SHADERS> m_shaderAlloc;
     Buffer m_buffers[MAX_BUFFERS];
-    HandleAllocator<BufferHandle> m_bufferAlloc;
+    HandleAllocator<BufferHandle, MAX_BUFFERS> m_bufferAlloc;
+    std::vector<BufferHandle> m_transientBuffers;
+    OcclusionQuerySet m_occlusionQueries;
+    HandleAllocator<OcclusionQueryHandle, MAX_OCCLUSION_QUERIES> m_occlusionQueryAlloc;
+    MaterialTable m_materialTable;
+    HandleAllocator<MaterialHandle, MAX_MATERIALS> m_materialAlloc;
+    // Layer 0 of the texture array is the white fallback
+    HandleAllocator<MaterialTextureHandle, MAX_MATERIAL_LAYERS - 1> m_materialTextureAlloc;
+    DeletionQueue m_deletionQueue;
+    FrameFence m_frameFence;
+    FrameTimer m_frameTimer;
+    ResolutionController m_resolutionController;
+    UpscalePass m_upscalePass;
   };
 }
\ No newline at end of file